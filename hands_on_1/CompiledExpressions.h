@@ -0,0 +1,277 @@
+//
+//  CompiledExpressions.h - replace interpreted expr:: formulas by compiled function objects
+//
+//  The factory expression
+//
+//      expr::Nexp('mu*S+B',mu[1,-1,10],S[10],B[20])
+//
+//  creates a RooFormulaVar, whose formula is interpreted (JIT compiled by TFormula) every
+//  time a workspace is built or read back from file. The functions below instead turn each
+//  formula into a dedicated C++ class, generated with RooClassFactory::makeFunction and
+//  compiled with ACLiC.
+//
+//  The generated code is kept in a cache directory, keyed by an MD5 hash of the formula
+//  and its argument names. A formula that was compiled before, in this or in an earlier
+//  job (e.g. in toy jobs that all read the same model.root), is simply loaded again
+//  without recompilation. Jobs that share the cache directory (e.g. toy jobs started at the
+//  same time on a cold cache) hold an exclusive lock on <cacheDir>/.lock while they generate
+//  and compile a class, and the generated files are written in a private directory and moved
+//  into the cache with an atomic rename. Another job therefore never sees a half-written
+//  source, nor loads a library that is still being compiled
+//
+//    compiledExpr(name,formula,args)           : return a compiled function object for the formula
+//    factoryCompiled(w,spec)                    : like w.factory(spec), but expr:: specifications
+//                                                 are imported as compiled function objects
+//    compileWorkspaceExpressions(w)             : replace every RooFormulaVar in a workspace
+//                                                 (e.g. one just read from file) by its compiled
+//                                                 equivalent, returns the number of replacements
+//
+//  Formulas must be valid C++ expressions of their arguments (e.g. x*x instead of x^2).
+//  References of the form @0, @1 are translated to the argument names
+//
+//  Use in a macro with #include "CompiledExpressions.h"
+//
+
+#ifndef COMPILEDEXPRESSIONS_H
+#define COMPILEDEXPRESSIONS_H
+
+#include "RooWorkspace.h"
+#include "RooFormulaVar.h"
+#include "RooClassFactory.h"
+#include "RooArgList.h"
+#include "TMD5.h"
+#include "TROOT.h"
+#include "TSystem.h"
+#include "TString.h"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+// Default location of the generated and compiled code. All definitions in this header are
+// const or inline, so that it can be included in several compiled macros of the same job
+const char* const compiledExprDefaultCacheDir = ".exprcache" ;
+
+
+// Exclusive lock on the cache directory, held from construction until destruction.
+// flock() blocks until the jobs that hold the lock have released it
+struct CompiledExprLock {
+  int fd ;
+  CompiledExprLock(const char* cacheDir) {
+    gSystem->mkdir(cacheDir,kTRUE) ;
+    fd = ::open(TString::Format("%s/.lock",cacheDir).Data(),O_RDWR|O_CREAT,0644) ;
+    if (fd<0 || flock(fd,LOCK_EX)!=0) {
+      std::cout << "compiledExpr: WARNING cannot lock " << cacheDir << ", concurrent jobs may conflict" << std::endl ;
+    }
+  }
+  ~CompiledExprLock() { if (fd>=0) ::close(fd) ; }
+} ;
+
+
+// Return the name of the generated class for the given formula and argument names
+inline TString compiledExprClassName(const char* formula, const RooArgList& args)
+{
+  TString key(formula) ;
+  for (int i=0 ; i<args.getSize() ; i++) key += TString("|") + args.at(i)->GetName() ;
+  TMD5 md5 ;
+  md5.Update((const UChar_t*)key.Data(),key.Length()) ;
+  md5.Final() ;
+  return TString("RooCompiledExpr_") + TString(md5.AsString())(0,16) ;
+}
+
+
+// Return a compiled function object 'name' that calculates formula of args. The class
+// implementing the formula is generated and compiled only if it is not yet in the cache.
+// Returns 0 if the class could not be generated, compiled or instantiated
+inline RooAbsReal* compiledExpr(const char* name, const char* formula, const RooArgList& args,
+                                const char* cacheDir=compiledExprDefaultCacheDir)
+{
+  // Translate @i references to argument names (highest index first, so that @1 does not match @10)
+  TString expr(formula) ;
+  for (int i=args.getSize()-1 ; i>=0 ; i--) {
+    expr.ReplaceAll(Form("@%d",i),args.at(i)->GetName()) ;
+  }
+
+  TString className = compiledExprClassName(expr,args) ;
+  TString source = TString::Format("%s/%s.cxx",cacheDir,className.Data()) ;
+
+  if (!TClass::GetClass(className,kFALSE,kTRUE)) {
+    // Generation and compilation are done under the lock of the cache directory
+    CompiledExprLock lock(cacheDir) ;
+
+    // Generate the class, unless it exists already. The files are written in a directory
+    // private to this process and then renamed into the cache, the header before the source,
+    // since the existence of the source marks a complete class
+    if (gSystem->AccessPathName(source)) {
+      TString argNames ;
+      for (int i=0 ; i<args.getSize() ; i++) {
+        if (i>0) argNames += "," ;
+        argNames += args.at(i)->GetName() ;
+      }
+      TString tmpDir = TString::Format("%s/tmp_%s_%d",cacheDir,gSystem->HostName(),gSystem->GetPid()) ;
+      gSystem->mkdir(tmpDir,kTRUE) ;
+      TString cwd = gSystem->WorkingDirectory() ;
+      gSystem->ChangeDirectory(tmpDir) ;
+      Bool_t failed = RooClassFactory::makeFunction(className,argNames,0,expr) ;
+      gSystem->ChangeDirectory(cwd) ;
+      TString tmpHeader = TString::Format("%s/%s.h",tmpDir.Data(),className.Data()) ;
+      TString tmpSource = TString::Format("%s/%s.cxx",tmpDir.Data(),className.Data()) ;
+      if (!failed) {
+        failed = gSystem->Rename(tmpHeader,TString::Format("%s/%s.h",cacheDir,className.Data())) ||
+                 gSystem->Rename(tmpSource,source) ;
+      }
+      gSystem->Unlink(tmpHeader) ;
+      gSystem->Unlink(tmpSource) ;
+      gSystem->Unlink(tmpDir) ;
+      if (failed || gSystem->AccessPathName(source)) {
+        std::cout << "compiledExpr: ERROR cannot generate class for " << name << " = " << expr << std::endl ;
+        return 0 ;
+      }
+    }
+
+    // Load the class. ACLiC only compiles if the library is missing or older than the source.
+    // A formula that is not valid C++ in terms of the argument names fails to compile here
+    Int_t error(0) ;
+    gROOT->ProcessLine(Form(".L %s+",source.Data()),&error) ;
+    if (error || !TClass::GetClass(className,kFALSE,kTRUE)) {
+      std::cout << "compiledExpr: ERROR cannot compile " << source << " for " << name << " = " << expr << std::endl ;
+      return 0 ;
+    }
+  }
+
+  // Instantiate the class with the given arguments
+  TString ctor = TString::Format("new %s(\"%s\",\"%s\"",className.Data(),name,expr.Data()) ;
+  for (int i=0 ; i<args.getSize() ; i++) {
+    ctor += TString::Format(",*(RooAbsReal*)0x%lx",(ULong_t)args.at(i)) ;
+  }
+  ctor += ") ;" ;
+  Int_t error(0) ;
+  RooAbsReal* func = (RooAbsReal*) gROOT->ProcessLineFast(ctor,&error) ;
+  if (error || !func) {
+    std::cout << "compiledExpr: ERROR cannot instantiate " << className << " for " << name << std::endl ;
+    return 0 ;
+  }
+  return func ;
+}
+
+
+// Split the argument list of a factory specification at the top-level commas
+inline std::vector<TString> compiledExprSplitArgs(const TString& argList)
+{
+  std::vector<TString> result ;
+  int depth(0), begin(0) ;
+  bool quoted = false ;
+  for (int i=0 ; i<argList.Length() ; i++) {
+    char c = argList[i] ;
+    if (c=='\'') quoted = !quoted ;
+    if (quoted) continue ;
+    if (c=='(' || c=='[' || c=='{') depth++ ;
+    if (c==')' || c==']' || c=='}') depth-- ;
+    if (c==',' && depth==0) {
+      result.push_back(argList(begin,i-begin)) ;
+      begin = i+1 ;
+    }
+  }
+  result.push_back(argList(begin,argList.Length()-begin)) ;
+  return result ;
+}
+
+
+// Process a factory specification like RooWorkspace::factory, but import expr::name('formula',args)
+// specifications as compiled function objects. Arguments may be declared inline (mu[1,-1,10])
+inline RooAbsArg* factoryCompiled(RooWorkspace& w, const char* spec, const char* cacheDir=compiledExprDefaultCacheDir)
+{
+  TString s(spec) ;
+  if (!s.BeginsWith("expr::")) return w.factory(spec) ;
+
+  // Decompose expr::name('formula',arg1,arg2,...)
+  Ssiz_t open = s.Index("(") ;
+  Ssiz_t close = s.Last(')') ;
+  if (open==kNPOS || close<open) {
+    std::cout << "factoryCompiled: ERROR malformed specification " << spec << std::endl ;
+    return 0 ;
+  }
+  TString name = s(6,open-6) ;
+  std::vector<TString> items = compiledExprSplitArgs(s(open+1,close-open-1)) ;
+  TString formula = items[0].Strip(TString::kBoth) ;
+  formula = formula.Strip(TString::kBoth,'\'') ;
+
+  // Let the factory create (or look up) each argument
+  RooArgList args ;
+  for (unsigned int i=1 ; i<items.size() ; i++) {
+    RooAbsArg* arg = w.factory(TString(items[i].Strip(TString::kBoth)).Data()) ;
+    if (!arg) return 0 ;
+    args.add(*arg) ;
+  }
+
+  RooAbsReal* func = compiledExpr(name,formula,args,cacheDir) ;
+  if (!func) return 0 ;
+  w.import(*func,RooFit::Silence()) ;
+  delete func ;
+  return w.function(name) ;
+}
+
+
+// Replace every RooFormulaVar in the workspace by a compiled equivalent. The compiled object
+// is imported as <name>_compiled, and all clients of the formula are redirected to it.
+// All formulas are compiled before any client is redirected, since the formula text refers
+// to the original names of its arguments (e.g. kH2 in the formula of mu_ex06_func, and not
+// kH2_compiled). A formula that fails to compile is left in place
+inline int compileWorkspaceExpressions(RooWorkspace& w, const char* cacheDir=compiledExprDefaultCacheDir)
+{
+  std::vector<RooFormulaVar*> formulas ;
+  std::vector<RooAbsReal*> compiledFuncs ;
+
+  RooArgSet allFuncs = w.allFunctions() ;
+  TIterator* iter = allFuncs.createIterator() ;
+  RooAbsArg* arg ;
+  while ((arg=(RooAbsArg*)iter->Next())) {
+    RooFormulaVar* fv = dynamic_cast<RooFormulaVar*>(arg) ;
+    if (!fv) continue ;
+
+    // The formula is retrieved through printMetaArgs, which prints it as formula="..."
+    std::ostringstream os ;
+    fv->printMetaArgs(os) ;
+    TString meta(os.str().c_str()) ;
+    Ssiz_t begin = meta.Index("\"")+1 ;
+    TString formula = meta(begin,meta.Last('"')-begin) ;
+
+    RooArgList args ;
+    for (int i=0 ; fv->getParameter(i) ; i++) args.add(*fv->getParameter(i)) ;
+
+    RooAbsReal* func = compiledExpr(Form("%s_compiled",fv->GetName()),formula,args,cacheDir) ;
+    if (!func) {
+      std::cout << "compileWorkspaceExpressions: WARNING keeping interpreted formula " << fv->GetName() << std::endl ;
+      continue ;
+    }
+    func->setAttribute(Form("ORIGNAME:%s",fv->GetName())) ;
+    w.import(*func,RooFit::Silence()) ;
+    delete func ;
+
+    formulas.push_back(fv) ;
+    compiledFuncs.push_back(w.function(Form("%s_compiled",fv->GetName()))) ;
+  }
+  delete iter ;
+
+  // Redirect all clients of each formula to its compiled object. The clients include the compiled
+  // objects of other formulas that take this formula as argument
+  for (unsigned int k=0 ; k<formulas.size() ; k++) {
+    RooArgSet clients ;
+    TIterator* citer = formulas[k]->clientIterator() ;
+    RooAbsArg* client ;
+    while ((client=(RooAbsArg*)citer->Next())) clients.add(*client,kTRUE) ;
+    delete citer ;
+    TIterator* riter = clients.createIterator() ;
+    while ((client=(RooAbsArg*)riter->Next())) {
+      client->redirectServers(RooArgSet(*compiledFuncs[k]),kFALSE,kTRUE) ;
+    }
+    delete riter ;
+  }
+  return formulas.size() ;
+}
+
+#endif
@@ -0,0 +1,463 @@
+//
+//  ProfileScan.h - warm-started, parallel and cached profile likelihood scans
+//
+//  A profile likelihood scan, as done by nll->createProfile(mu) in ex01 or by the
+//  LikelihoodIntervalPlot in ex03, minimizes the likelihood w.r.t. all nuisance parameters
+//  at each value of the parameter of interest, every time starting from the same values.
+//  The ProfileScan class
+//
+//   - starts at the best fit, and walks outward in both directions, starting each conditional
+//     fit from the nuisance parameters found at the neighbouring point (warm start)
+//   - splits the scan points in contiguous segments, which are processed by separate worker
+//     processes (ROOT::TProcessExecutor). Each segment walks away from the best fit, starting
+//     from the conditional minimum nearest to it that is already known
+//   - keeps all conditional minima (value of the parameter of interest, minimum of the
+//     likelihood and the nuisance parameters) in a cache, that can be stored in a file.
+//     Points that are in the cache are not fitted again, and new fits start from the
+//     nearest cached point. The interval finder, the plot and later scans of the same
+//     likelihood (e.g. with more points) all use the cache
+//
+//  Usage
+//
+//    ProfileScan scan(*nll,*w.var("mu"),"profile_cache.root") ;
+//    scan.Scan(0,6,50,4) ;                        // 50 points in [0,6] with 4 workers
+//    double lo, hi ;
+//    scan.Interval(0.90,lo,hi) ;                  // 90% CL interval from -log(lambda) = 1.35
+//    scan.Graph()->Draw("APL") ;                  // -log(lambda) of all cached points
+//    scan.Print() ;                               // fits, function calls and wall time
+//
+//  Use in a macro with #include "ProfileScan.h"
+//
+
+#ifndef PROFILESCAN_H
+#define PROFILESCAN_H
+
+#include "RooAbsReal.h"
+#include "RooRealVar.h"
+#include "RooArgList.h"
+#include "RooArgSet.h"
+#include "RooMinimizer.h"
+#include "ROOT/TProcessExecutor.hxx"
+#include "Math/DistFunc.h"
+#include "TFile.h"
+#include "TTree.h"
+#include "TNamed.h"
+#include "TGraph.h"
+#include "TStopwatch.h"
+#include "TVectorD.h"
+#include "TSystem.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <iostream>
+
+class ProfileScan {
+public:
+
+  // Conditional minimum of the likelihood at one value of the parameter of interest
+  struct Point {
+    double nll ;                // minimum of the likelihood
+    int status ;                // status of the minimization
+    std::vector<double> nuis ;  // nuisance parameters at the minimum
+  } ;
+
+  ProfileScan(RooAbsReal& nll, RooRealVar& poi, const char* cacheFile=0) :
+    _nll(&nll), _poi(&poi), _cacheFile(cacheFile ? cacheFile : ""), _warmStart(true), _haveBest(false),
+    _nFits(0), _nCalls(0), _wallTime(0), _minNll(0), _poiHat(0)
+  {
+    // The nuisance parameters are all floating parameters of the likelihood except the parameter of interest
+    RooArgSet* params = nll.getParameters(RooArgSet()) ;
+    TIterator* iter = params->createIterator() ;
+    RooAbsArg* arg ;
+    while ((arg=(RooAbsArg*)iter->Next())) {
+      RooRealVar* v = dynamic_cast<RooRealVar*>(arg) ;
+      if (v && !v->isConstant() && v!=&poi && strcmp(v->GetName(),poi.GetName())) _nuis.add(*v) ;
+    }
+    delete iter ;
+    delete params ;
+
+    // The cache is only valid for the same likelihood, parameter of interest and nuisance parameters.
+    // ReadCache() also checks that the likelihood reproduces the cached minimum
+    _key = TString::Format("%s|%s",nll.GetName(),poi.GetName()) ;
+    for (int i=0 ; i<_nuis.getSize() ; i++) _key += TString("|") + _nuis.at(i)->GetName() ;
+
+    ReadCache() ;
+    GlobalFit() ;
+  }
+
+  // Start each fit from the values of the neighbouring point (default), or from the best fit values
+  void SetWarmStart(bool flag) { _warmStart = flag ; }
+
+  // Calculate the profile at nPoints equidistant points in [lo,hi] that are not yet in the cache,
+  // using nWorkers worker processes
+  void Scan(double lo, double hi, int nPoints, int nWorkers=1)
+  {
+    std::vector<double> todo ;
+    for (int i=0 ; i<nPoints ; i++) {
+      double x = (nPoints>1) ? lo + i*(hi-lo)/(nPoints-1) : lo ;
+      if (!Find(x)) todo.push_back(x) ;
+    }
+    Fit(todo,nWorkers) ;
+  }
+
+  // Return -log(lambda) at x, fitting only if x is not yet in the cache
+  double Profile(double x)
+  {
+    if (!Find(x)) Fit(std::vector<double>(1,x),1) ;
+    return Find(x)->nll - _minNll ;
+  }
+
+  // Find the interval with -log(lambda) < 0.5*chi2_quantile(cl), as the LikelihoodInterval does.
+  // The crossings are bracketed with the cached points and refined with the secant method. Returns
+  // false if there is no crossing on one of the sides within the range of the parameter of interest
+  bool Interval(double cl, double& lower, double& upper, double tolerance=1e-4)
+  {
+    double threshold = 0.5*ROOT::Math::chisquared_quantile(cl,1) ;
+    bool ok = FindCrossing(threshold,-1,lower,tolerance) ;
+    ok &= FindCrossing(threshold,+1,upper,tolerance) ;
+    return ok ;
+  }
+
+  // Graph of -log(lambda) for all cached points
+  TGraph* Graph() const
+  {
+    TGraph* g = new TGraph ;
+    for (auto& p : _cache) g->SetPoint(g->GetN(),p.first,p.second.nll-_minNll) ;
+    g->SetTitle(Form("Profile likelihood;%s;-log #lambda(%s)",_poi->GetName(),_poi->GetName())) ;
+    return g ;
+  }
+
+  // Write the cache to the cache file
+  void WriteCache() const
+  {
+    if (_cacheFile.IsNull()) return ;
+    TString tmpName = _cacheFile + ".tmp" ;
+    TFile f(tmpName,"RECREATE") ;
+    TNamed key("key",_key.Data()) ;
+    key.Write() ;
+    TVectorD best(2+_best.nuis.size()) ;
+    best[0] = _poiHat ;
+    best[1] = _minNll ;
+    for (size_t i=0 ; i<_best.nuis.size() ; i++) best[2+i] = _best.nuis[i] ;
+    best.Write("best") ;
+    double x, nll ;
+    int status ;
+    std::vector<double> nuis ;
+    TTree t("profile","Conditional minima of the likelihood") ;
+    t.Branch("poi",&x) ;
+    t.Branch("nll",&nll) ;
+    t.Branch("status",&status) ;
+    t.Branch("nuis",&nuis) ;
+    for (auto& p : _cache) {
+      x = p.first ; nll = p.second.nll ; status = p.second.status ; nuis = p.second.nuis ;
+      t.Fill() ;
+    }
+    t.Write() ;
+    f.Close() ;
+    gSystem->Rename(tmpName,_cacheFile) ;
+  }
+
+  void Print() const
+  {
+    std::cout << "ProfileScan: " << _cache.size() << " cached points, " << _nFits << " fits, "
+              << _nCalls << " likelihood evaluations, " << _wallTime << " s" << std::endl ;
+  }
+
+  int NumFits() const { return _nFits ; }
+  Long64_t NumCalls() const { return _nCalls ; }
+  double WallTime() const { return _wallTime ; }
+  double BestFit() const { return _poiHat ; }
+  int NumCached() const { return _cache.size() ; }
+  void ResetCounters() { _nFits = 0 ; _nCalls = 0 ; _wallTime = 0 ; }
+
+private:
+
+  // Return the cached point at x (within a small tolerance), or 0
+  const Point* Find(double x) const
+  {
+    double eps = 1e-9*(_poi->getMax()-_poi->getMin()) ;
+    auto it = _cache.lower_bound(x-eps) ;
+    if (it!=_cache.end() && it->first<=x+eps) return &it->second ;
+    return 0 ;
+  }
+
+  // Minimize the likelihood with the parameter of interest fixed at x, starting from the
+  // nuisance parameters in start. Returns the point and adds the number of calls to nCalls
+  Point Minimize(double x, const std::vector<double>& start, Long64_t& nCalls)
+  {
+    for (int i=0 ; i<_nuis.getSize() ; i++) ((RooRealVar*)_nuis.at(i))->setVal(start[i]) ;
+    bool wasConstant = _poi->isConstant() ;
+    _poi->setVal(x) ;
+    _poi->setConstant(true) ;
+
+    // Without nuisance parameters the profile is the likelihood itself
+    Point p ;
+    p.status = 0 ;
+    if (_nuis.getSize()>0) {
+      RooMinimizer m(*_nll) ;
+      m.setPrintLevel(-1) ;
+      p.status = m.minimize("Minuit2","Migrad") ;
+      nCalls += m.evalCounter() ;
+    } else {
+      nCalls++ ;
+    }
+    p.nll = _nll->getVal() ;
+    for (int i=0 ; i<_nuis.getSize() ; i++) p.nuis.push_back(((RooRealVar*)_nuis.at(i))->getVal()) ;
+
+    _poi->setConstant(wasConstant) ;
+    return p ;
+  }
+
+  // Unconditional fit, unless the best fit was read from the cache
+  void GlobalFit()
+  {
+    if (_haveBest) return ;
+    TStopwatch t ;
+
+    RooArgSet* params = _nll->getParameters(RooArgSet()) ;
+    RooArgSet* initParams = (RooArgSet*) params->snapshot() ;
+
+    bool wasConstant = _poi->isConstant() ;
+    _poi->setConstant(false) ;
+    RooMinimizer m(*_nll) ;
+    m.setPrintLevel(-1) ;
+    _best.status = m.minimize("Minuit2","Migrad") ;
+    _nFits++ ;
+    _nCalls += m.evalCounter() ;
+    _poiHat = _poi->getVal() ;
+    _minNll = _nll->getVal() ;
+    _best.nll = _minNll ;
+    _best.nuis.clear() ;
+    for (int i=0 ; i<_nuis.getSize() ; i++) _best.nuis.push_back(((RooRealVar*)_nuis.at(i))->getVal()) ;
+    _haveBest = true ;
+    _poi->setConstant(wasConstant) ;
+
+    *params = *initParams ;
+    delete initParams ;
+    delete params ;
+    _wallTime += t.RealTime() ;
+  }
+
+  // Calculate the profile at all points xs, in contiguous segments processed by nWorkers workers
+  void Fit(std::vector<double> xs, int nWorkers)
+  {
+    if (xs.empty()) return ;
+    TStopwatch t ;
+
+    RooArgSet* params = _nll->getParameters(RooArgSet()) ;
+    RooArgSet* initParams = (RooArgSet*) params->snapshot() ;
+
+    // Split the points on each side of the best fit in segments, ordered from the best fit outward
+    std::sort(xs.begin(),xs.end()) ;
+    std::vector<double> left, right ;
+    for (double x : xs) (x<_poiHat ? left : right).push_back(x) ;
+    std::reverse(left.begin(),left.end()) ;
+
+    std::vector<std::vector<double>> segments ;
+    int nSeg = std::max(nWorkers,1) ;
+    for (auto* side : { &left, &right }) {
+      if (side->empty()) continue ;
+      int nSide = std::min<int>(side->size(),std::max(1,(int)(nSeg*side->size()/xs.size()))) ;
+      for (int s=0 ; s<nSide ; s++) {
+        segments.push_back(std::vector<double>(side->begin()+s*side->size()/nSide,side->begin()+(s+1)*side->size()/nSide)) ;
+      }
+    }
+
+    // Each segment returns for each point (x, nll, status, nCalls, nuisance parameters...)
+    const int nNuis = _nuis.getSize() ;
+    auto runSegment = [&](int iseg) {
+      std::vector<double> result ;
+      std::vector<double> start = _best.nuis ;
+      bool first = true ;
+      for (double x : segments[iseg]) {
+        // The first point of a segment starts from the nearest known conditional minimum (or the
+        // best fit), later points from the previous point. Without warm start every fit starts
+        // from the best fit
+        if (!_warmStart) {
+          start = _best.nuis ;
+        } else if (first && !_cache.empty()) {
+          double xNear = NearestX(x) ;
+          if (fabs(xNear-x)<fabs(_poiHat-x)) start = Find(xNear)->nuis ;
+        }
+        first = false ;
+
+        Long64_t nCalls = 0 ;
+        Point p = Minimize(x,start,nCalls) ;
+        start = p.nuis ;
+        result.push_back(x) ;
+        result.push_back(p.nll) ;
+        result.push_back(p.status) ;
+        result.push_back(nCalls) ;
+        result.insert(result.end(),p.nuis.begin(),p.nuis.end()) ;
+      }
+      return result ;
+    } ;
+
+    std::vector<std::vector<double>> results ;
+    if (nWorkers>1 && segments.size()>1) {
+      ROOT::TProcessExecutor workers(std::min<int>(nWorkers,segments.size())) ;
+      results = workers.Map(runSegment,ROOT::TSeqI(segments.size())) ;
+    } else {
+      for (unsigned int iseg=0 ; iseg<segments.size() ; iseg++) results.push_back(runSegment(iseg)) ;
+    }
+
+    for (auto& r : results) {
+      for (size_t k=0 ; k+4+nNuis<=r.size() ; k+=4+nNuis) {
+        Point p ;
+        p.nll = r[k+1] ;
+        p.status = (int)r[k+2] ;
+        p.nuis.assign(r.begin()+k+4,r.begin()+k+4+nNuis) ;
+        _cache[r[k]] = p ;
+        _nCalls += (Long64_t)r[k+3] ;
+        _nFits++ ;
+      }
+    }
+
+    *params = *initParams ;
+    delete initParams ;
+    delete params ;
+
+    _wallTime += t.RealTime() ;
+    WriteCache() ;
+  }
+
+  // Value of the parameter of interest of the cached point nearest to x
+  double NearestX(double x) const
+  {
+    double best = 1e300 ;
+    for (auto& p : _cache) if (fabs(p.first-x)<fabs(best-x)) best = p.first ;
+    return best ;
+  }
+
+  // Find the crossing of -log(lambda) with threshold on the given side (-1 or +1) of the best fit
+  bool FindCrossing(double threshold, int side, double& crossing, double tolerance)
+  {
+    double range = _poi->getMax()-_poi->getMin() ;
+    double limit = (side<0) ? _poi->getMin() : _poi->getMax() ;
+
+    // Bracket the crossing between the best fit (inside) and the first cached point outside,
+    // scanning outward in steps of 5% of the range if there is none
+    double in(_poiHat), out(limit) ;
+    bool bracketed = false ;
+    for (auto& p : _cache) {
+      double x = p.first ;
+      if ((x-_poiHat)*side<=0) continue ;
+      if (p.second.nll-_minNll<threshold) {
+        if ((x-in)*side>0) in = x ;
+      } else if (!bracketed || (x-out)*side<0) {
+        out = x ;
+        bracketed = true ;
+      }
+    }
+    while (!bracketed) {
+      double x = in + side*0.05*range ;
+      if ((x-limit)*side>=0) {
+        if (Profile(limit)<threshold) return false ;
+        out = limit ;
+        break ;
+      }
+      if (Profile(x)>=threshold) { out = x ; break ; }
+      in = x ;
+    }
+    // The bracket may have moved inward by cached points between in and out
+    for (auto& p : _cache) {
+      double x = p.first ;
+      if ((x-in)*side>0 && (x-out)*side<0) {
+        if (p.second.nll-_minNll<threshold) in = x ; else out = x ;
+      }
+    }
+
+    // Secant (regula falsi) refinement, each new fit starts from the nearest cached point
+    double fIn = (in==_poiHat) ? 0 : Profile(in) ;
+    double fOut = Profile(out) ;
+    crossing = out ;
+    for (int iter=0 ; iter<50 && fabs(out-in)>tolerance*range ; iter++) {
+      double x = in + (threshold-fIn)*(out-in)/(fOut-fIn) ;
+      // Avoid the slow one-sided convergence of regula falsi by bisecting when x is close to a side
+      if (fabs(x-in)<0.1*fabs(out-in) || fabs(x-out)<0.1*fabs(out-in)) x = 0.5*(in+out) ;
+      double fx = Profile(x) ;
+      crossing = x ;
+      if (fabs(fx-threshold)<1e-6) break ;
+      if (fx<threshold) { in = x ; fIn = fx ; } else { out = x ; fOut = fx ; }
+    }
+    return true ;
+  }
+
+  // Value of the likelihood at poi=x and the given nuisance parameters, leaving all parameters unchanged
+  double NllAt(double x, const double* nuis) const
+  {
+    RooArgSet* params = _nll->getParameters(RooArgSet()) ;
+    RooArgSet* initParams = (RooArgSet*) params->snapshot() ;
+    _poi->setVal(x) ;
+    for (int i=0 ; i<_nuis.getSize() ; i++) ((RooRealVar*)_nuis.at(i))->setVal(nuis[i]) ;
+    double nll = _nll->getVal() ;
+    *params = *initParams ;
+    delete initParams ;
+    delete params ;
+    return nll ;
+  }
+
+  // Read the cache file, if it exists and belongs to the same likelihood and data
+  void ReadCache()
+  {
+    if (_cacheFile.IsNull() || gSystem->AccessPathName(_cacheFile)) return ;
+    TFile f(_cacheFile) ;
+    TNamed* key = (TNamed*) f.Get("key") ;
+    TTree* t = (TTree*) f.Get("profile") ;
+    TVectorD* best = (TVectorD*) f.Get("best") ;
+    if (!key || !t || !best || _key!=key->GetTitle()) {
+      std::cout << "ProfileScan: cache " << _cacheFile << " belongs to another likelihood, ignored" << std::endl ;
+      return ;
+    }
+
+    // The names do not identify the data and the model. As a fingerprint, the likelihood is evaluated
+    // at the cached best fit, which must reproduce the cached minimum
+    if (best->GetNrows()!=2+_nuis.getSize() || fabs(NllAt((*best)[0],best->GetMatrixArray()+2)-(*best)[1]) > 1e-6*std::max(1.,fabs((*best)[1]))) {
+      std::cout << "ProfileScan: cache " << _cacheFile << " does not reproduce the likelihood at its best fit, ignored" << std::endl ;
+      return ;
+    }
+    _poiHat = (*best)[0] ;
+    _minNll = (*best)[1] ;
+    _best.nll = _minNll ;
+    _best.status = 0 ;
+    for (int i=2 ; i<best->GetNrows() ; i++) _best.nuis.push_back((*best)[i]) ;
+    _haveBest = true ;
+
+    double x, nll ;
+    int status ;
+    std::vector<double>* nuis = 0 ;
+    t->SetBranchAddress("poi",&x) ;
+    t->SetBranchAddress("nll",&nll) ;
+    t->SetBranchAddress("status",&status) ;
+    t->SetBranchAddress("nuis",&nuis) ;
+    for (Long64_t i=0 ; i<t->GetEntries() ; i++) {
+      t->GetEntry(i) ;
+      Point p ;
+      p.nll = nll ;
+      p.status = status ;
+      p.nuis = *nuis ;
+      _cache[x] = p ;
+    }
+    std::cout << "ProfileScan: read " << _cache.size() << " points from " << _cacheFile << std::endl ;
+  }
+
+  RooAbsReal* _nll ;
+  RooRealVar* _poi ;
+  RooArgList _nuis ;
+  TString _cacheFile ;
+  TString _key ;
+  bool _warmStart ;
+
+  std::map<double,Point> _cache ;  // conditional minima, by value of the parameter of interest
+  Point _best ;                    // unconditional minimum
+  bool _haveBest ;
+
+  int _nFits ;
+  Long64_t _nCalls ;
+  double _wallTime ;
+  double _minNll ;
+  double _poiHat ;
+} ;
+
+#endif
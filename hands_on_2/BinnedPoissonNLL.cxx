@@ -0,0 +1,636 @@
+//
+//  BinnedPoissonNLL - a fast binned Poisson likelihood for template models like that of ex12
+//
+//  See BinnedPoissonNLL.h for a description
+//
+
+#include "BinnedPoissonNLL.h"
+
+#include "RooRealSumPdf.h"
+#include "RooProdPdf.h"
+#include "RooHistFunc.h"
+#include "PiecewiseInterpolation.h"
+#include "RooRealVar.h"
+#include "RooMsgService.h"
+#include "Math/IFunction.h"
+#include "Math/Minimizer.h"
+#include "Math/Factory.h"
+#include "TClass.h"
+#include "TDataMember.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+ClassImp(BinnedPoissonNLL) ;
+
+
+namespace {
+
+  // Sum of an array with four independent accumulators, which allows the compiler to
+  // vectorize the reduction without reordering floating point additions (-ffast-math)
+  double sumArray(const double* x, Int_t n)
+  {
+    double s0(0), s1(0), s2(0), s3(0) ;
+    Int_t i = 0 ;
+    for ( ; i+3<n ; i+=4) {
+      s0 += x[i] ; s1 += x[i+1] ; s2 += x[i+2] ; s3 += x[i+3] ;
+    }
+    for ( ; i<n ; i++) s0 += x[i] ;
+    return (s0+s1)+(s2+s3) ;
+  }
+
+  // Adapter that presents a BinnedPoissonNLL with its analytic gradient to the ROOT::Math minimizers
+  class GradFunction : public ROOT::Math::IMultiGradFunction {
+  public:
+    GradFunction(BinnedPoissonNLL& nll, const RooArgList& params) : _nll(nll), _params(params), _grad(params.getSize()) {}
+    ROOT::Math::IMultiGenFunction* Clone() const { return new GradFunction(_nll,_params) ; }
+    unsigned int NDim() const { return _params.getSize() ; }
+    void Gradient(const double* x, double* grad) const {
+      setParams(x) ;
+      _nll.gradient(_params,_grad) ;
+      for (unsigned int i=0 ; i<_grad.size() ; i++) grad[i] = _grad[i] ;
+    }
+  private:
+    void setParams(const double* x) const {
+      for (Int_t i=0 ; i<_params.getSize() ; i++) ((RooRealVar&)_params[i]).setVal(x[i]) ;
+    }
+    double DoEval(const double* x) const {
+      setParams(x) ;
+      return _nll.getVal() ;
+    }
+    double DoDerivative(const double* x, unsigned int icoord) const {
+      Gradient(x,&_grad[0]) ;
+      return _grad[icoord] ;
+    }
+    BinnedPoissonNLL& _nll ;
+    RooArgList _params ;
+    mutable std::vector<double> _grad ;
+  } ;
+
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Construct the likelihood of the given template model and binned data. The
+/// contents of the templates and the data are copied into flat arrays here
+
+BinnedPoissonNLL::BinnedPoissonNLL(const char* name, const char* title, RooAbsPdf& pdf, RooDataHist& data) :
+  RooAbsReal(name,title),
+  _coefs("coefs","Sample coefficients",this),
+  _constraints("constraints","Constraint terms",this),
+  _alphas("alphas","Morphing parameters",this),
+  _nBins(data.numEntries()),
+  _nMorphCalc(0)
+{
+  fillTemplates(pdf,data) ;
+  setupDependencies() ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+BinnedPoissonNLL::BinnedPoissonNLL(const BinnedPoissonNLL& other, const char* name) :
+  RooAbsReal(other,name),
+  _coefs("coefs",this,other._coefs),
+  _constraints("constraints",this,other._constraints),
+  _alphas("alphas",this,other._alphas),
+  _nBins(other._nBins),
+  _templates(other._templates),
+  _observed(other._observed),
+  _morphBegin(other._morphBegin),
+  _morphEnd(other._morphEnd),
+  _posDef(other._posDef),
+  _alphaIndex(other._alphaIndex),
+  _interpCode(other._interpCode),
+  _epsPlus(other._epsPlus),
+  _epsMinus(other._epsMinus),
+  _nMorphCalc(0)
+{
+  setupDependencies() ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Locate the RooRealSumPdf of templates (and the constraint terms, if the pdf
+/// is a product), and copy the template and observed bin contents. Other factors
+/// of the product must not depend on the observables
+
+void BinnedPoissonNLL::fillTemplates(RooAbsPdf& pdf, RooDataHist& data)
+{
+  RooRealSumPdf* sumPdf = dynamic_cast<RooRealSumPdf*>(&pdf) ;
+  if (RooProdPdf* prodPdf = dynamic_cast<RooProdPdf*>(&pdf)) {
+    for (Int_t i=0 ; i<prodPdf->pdfList().getSize() ; i++) {
+      RooAbsArg* term = prodPdf->pdfList().at(i) ;
+      if (!sumPdf && dynamic_cast<RooRealSumPdf*>(term)) {
+        sumPdf = (RooRealSumPdf*) term ;
+      } else if (dynamic_cast<RooAbsPdf*>(term) && !term->dependsOn(*data.get())) {
+        _constraints.add(*term) ;
+      } else {
+        throw std::invalid_argument(Form("BinnedPoissonNLL(%s): factor %s of %s depends on the observables and is not supported",
+                                         GetName(),term->GetName(),pdf.GetName())) ;
+      }
+    }
+  }
+  if (!sumPdf) {
+    throw std::invalid_argument(Form("BinnedPoissonNLL(%s): pdf %s is not a RooRealSumPdf or a product of one with constraints",GetName(),pdf.GetName())) ;
+  }
+  if (sumPdf->coefList().getSize()!=sumPdf->funcList().getSize()) {
+    throw std::invalid_argument(Form("BinnedPoissonNLL(%s): pdf %s must have one coefficient per template",GetName(),sumPdf->GetName())) ;
+  }
+
+  Int_t nSamples = sumPdf->funcList().getSize() ;
+  _templates.resize(nSamples*_nBins) ;
+  _observed.resize(_nBins) ;
+
+  _morphBegin.resize(nSamples) ;
+  _morphEnd.resize(nSamples) ;
+  _posDef.resize(nSamples) ;
+
+  for (Int_t s=0 ; s<nSamples ; s++) {
+    _coefs.add(*sumPdf->coefList().at(s)) ;
+
+    // A morphed sample stores its nominal template like an ordinary one, plus its variations
+    RooAbsArg* func = sumPdf->funcList().at(s) ;
+    _morphBegin[s] = _morphEnd[s] = _interpCode.size() ;
+    if (PiecewiseInterpolation* pi = dynamic_cast<PiecewiseInterpolation*>(func)) {
+      addMorphing(s,*pi,data) ;
+      func = (RooAbsArg*) pi->nominalHist() ;
+    }
+
+    RooHistFunc* hf = dynamic_cast<RooHistFunc*>(func) ;
+    if (!hf) {
+      throw std::invalid_argument(Form("BinnedPoissonNLL(%s): component %s is not a RooHistFunc",GetName(),func->GetName())) ;
+    }
+
+    for (Int_t i=0 ; i<_nBins ; i++) {
+      const RooArgSet* bin = data.get(i) ;
+      _templates[s*_nBins+i] = hf->dataHist().weight(*bin,0,kFALSE) * data.binVolume() ;
+    }
+  }
+
+  for (Int_t i=0 ; i<_nBins ; i++) {
+    data.get(i) ;
+    _observed[i] = data.weight() ;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Collect the normalization set of the constraint terms (their floating parameters,
+/// as for the constraint terms of createNLL), and which constraint terms and which
+/// coefficients depend on each parameter
+
+void BinnedPoissonNLL::setupDependencies()
+{
+  _constrNormSet.removeAll() ;
+  _constrOfParam.clear() ;
+  _coefsOfParam.clear() ;
+
+  for (Int_t j=0 ; j<_constraints.getSize() ; j++) {
+    RooArgSet* vars = _constraints.at(j)->getVariables() ;
+    TIterator* iter = vars->createIterator() ;
+    RooAbsArg* arg ;
+    while ((arg=(RooAbsArg*)iter->Next())) {
+      RooRealVar* var = dynamic_cast<RooRealVar*>(arg) ;
+      if (var && !var->isConstant()) _constrNormSet.add(*var,kTRUE) ;
+      _constrOfParam[arg->GetName()].push_back(j) ;
+    }
+    delete iter ;
+    delete vars ;
+  }
+
+  for (Int_t s=0 ; s<_coefs.getSize() ; s++) {
+    RooArgSet* vars = _coefs.at(s)->getVariables() ;
+    TIterator* iter = vars->createIterator() ;
+    RooAbsArg* arg ;
+    while ((arg=(RooAbsArg*)iter->Next())) {
+      _coefsOfParam[arg->GetName()].push_back(s) ;
+    }
+    delete iter ;
+    delete vars ;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Copy the variations of a PiecewiseInterpolation of RooHistFunc templates into
+/// the flat arrays eps+ = high - nominal and eps- = nominal - low
+
+void BinnedPoissonNLL::addMorphing(Int_t s, PiecewiseInterpolation& pi, RooDataHist& data)
+{
+  _posDef[s] = pi.positiveDefinite() ;
+
+  // PiecewiseInterpolation has no public accessor for its interpolation codes, so these are
+  // retrieved through its dictionary. The member is verified to exist with the expected type,
+  // so that a change of the class layout is an error rather than a wrong interpretation
+  TClass* cl = PiecewiseInterpolation::Class() ;
+  TDataMember* dm = cl ? cl->GetDataMember("_interpCode") : 0 ;
+  TString typeName = dm ? dm->GetTrueTypeName() : "" ;
+  typeName.ReplaceAll("std::","") ;
+  typeName.ReplaceAll(" ","") ;
+  if (!dm || typeName!="vector<int>" || dm->GetOffset()<=0) {
+    throw std::runtime_error(Form("BinnedPoissonNLL(%s): cannot determine the interpolation codes of %s, "
+                                  "PiecewiseInterpolation::_interpCode is missing or has an unexpected type",GetName(),pi.GetName())) ;
+  }
+  const std::vector<int>& codes = *(const std::vector<int>*)((const char*)&pi + dm->GetOffset()) ;
+
+  RooHistFunc* nom = dynamic_cast<RooHistFunc*>((RooAbsArg*)pi.nominalHist()) ;
+  if (!nom) {
+    throw std::invalid_argument(Form("BinnedPoissonNLL(%s): nominal of %s is not a RooHistFunc",GetName(),pi.GetName())) ;
+  }
+
+  for (Int_t j=0 ; j<pi.paramList().getSize() ; j++) {
+    RooHistFunc* low = dynamic_cast<RooHistFunc*>(pi.lowList().at(j)) ;
+    RooHistFunc* high = dynamic_cast<RooHistFunc*>(pi.highList().at(j)) ;
+    if (!low || !high) {
+      throw std::invalid_argument(Form("BinnedPoissonNLL(%s): variations of %s are not RooHistFuncs",GetName(),pi.GetName())) ;
+    }
+    Int_t code = j<(Int_t)codes.size() ? codes[j] : 0 ;
+    if (code!=0 && code!=4) {
+      throw std::invalid_argument(Form("BinnedPoissonNLL(%s): interpolation code %d of %s is not supported, only 0 and 4 are",GetName(),code,pi.GetName())) ;
+    }
+
+    // Each alpha appears only once in _alphas, even if it morphs several samples
+    RooAbsArg* alpha = pi.paramList().at(j) ;
+    if (!_alphas.find(alpha->GetName())) _alphas.add(*alpha) ;
+    _alphaIndex.push_back(_alphas.index(_alphas.find(alpha->GetName()))) ;
+    _interpCode.push_back(code) ;
+
+    for (Int_t i=0 ; i<_nBins ; i++) {
+      const RooArgSet* bin = data.get(i) ;
+      double vnom = nom->dataHist().weight(*bin,0,kFALSE) ;
+      double vlow = low->dataHist().weight(*bin,0,kFALSE) ;
+      double vhigh = high->dataHist().weight(*bin,0,kFALSE) ;
+      _epsPlus.push_back((vhigh-vnom) * data.binVolume()) ;
+      _epsMinus.push_back((vnom-vlow) * data.binVolume()) ;
+    }
+  }
+  _morphEnd[s] = _interpCode.size() ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Weights w+, w- of eps+ and eps- of variation j at alpha=x, following the
+/// definitions of PiecewiseInterpolation, and their derivatives w.r.t. x.
+///
+///   code 0 : w+ = x for x>0, w- = x for x<=0
+///   code 4 : w+ = x, w- = 0 for x>=1 and w+ = 0, w- = x for x<=-1, and inside [-1,1]
+///            w+/- = x/2 +/- (15x^2 - 10x^4 + 3x^6)/16
+
+void BinnedPoissonNLL::morphWeights(Int_t j, double x, double& wPlus, double& wMinus, double& dPlus, double& dMinus) const
+{
+  wPlus = wMinus = dPlus = dMinus = 0 ;
+  if (_interpCode[j]==0 || x>=1 || x<=-1) {
+    if (x>0) { wPlus = x ; dPlus = 1 ; } else { wMinus = x ; dMinus = 1 ; }
+    return ;
+  }
+  double x2 = x*x ;
+  double p = x2*(15 + x2*(-10 + 3*x2)) ;
+  double dp = x*(30 + x2*(-40 + 18*x2)) ;
+  wPlus = 0.5*x + 0.0625*p ;
+  wMinus = 0.5*x - 0.0625*p ;
+  dPlus = 0.5 + 0.0625*dp ;
+  dMinus = 0.5 - 0.0625*dp ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Calculate the cached contribution of variation j of sample s for the current alpha value
+
+void BinnedPoissonNLL::variationContribution(Int_t s, Int_t j) const
+{
+  const double* nom = &_templates[s*_nBins] ;
+  const double* ep = &_epsPlus[j*_nBins] ;
+  const double* em = &_epsMinus[j*_nBins] ;
+  double* c = &_contrib[j*_nBins] ;
+  double x = _alphaCache[j] ;
+  double wPlus, wMinus, dPlus, dMinus ;
+  morphWeights(j,x,wPlus,wMinus,dPlus,dMinus) ;
+  if (_interpCode[j]==4 && x>-1 && x<1) {
+    // Inside the polynomial region each variation alone may not make a bin negative
+    for (Int_t i=0 ; i<_nBins ; i++) {
+      c[i] = std::max(wPlus*ep[i] + wMinus*em[i], -nom[i]) ;
+    }
+  } else {
+    for (Int_t i=0 ; i<_nBins ; i++) {
+      c[i] = wPlus*ep[i] + wMinus*em[i] ;
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Copy the unclipped sum of sample s to its morphed template, truncated at zero
+/// for a positive-definite sample
+
+void BinnedPoissonNLL::truncateMorphed(Int_t s) const
+{
+  const double* sum = &_morphSum[s*_nBins] ;
+  double* m = &_morphed[s*_nBins] ;
+  if (_posDef[s]) {
+    for (Int_t i=0 ; i<_nBins ; i++) m[i] = std::max(sum[i],0.) ;
+  } else {
+    for (Int_t i=0 ; i<_nBins ; i++) m[i] = sum[i] ;
+  }
+  _nMorphCalc++ ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Recalculate the contributions of all variations of sample s, and their sum
+
+void BinnedPoissonNLL::morphSample(Int_t s) const
+{
+  const double* nom = &_templates[s*_nBins] ;
+  double* sum = &_morphSum[s*_nBins] ;
+  for (Int_t i=0 ; i<_nBins ; i++) sum[i] = nom[i] ;
+
+  for (Int_t j=_morphBegin[s] ; j<_morphEnd[s] ; j++) {
+    variationContribution(s,j) ;
+    const double* c = &_contrib[j*_nBins] ;
+    for (Int_t i=0 ; i<_nBins ; i++) sum[i] += c[i] ;
+  }
+  truncateMorphed(s) ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Update the sum of sample s for the given changed variations only, by replacing
+/// their old contributions with the new ones
+
+void BinnedPoissonNLL::updateMorphing(Int_t s, const std::vector<Int_t>& changed) const
+{
+  double* sum = &_morphSum[s*_nBins] ;
+  for (Int_t j : changed) {
+    double* c = &_contrib[j*_nBins] ;
+    for (Int_t i=0 ; i<_nBins ; i++) sum[i] -= c[i] ;
+    variationContribution(s,j) ;
+    for (Int_t i=0 ; i<_nBins ; i++) sum[i] += c[i] ;
+  }
+  truncateMorphed(s) ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Return the current template of sample s. For a morphed sample the cached
+/// morphed template is returned, unless one of its alpha parameters changed.
+/// In that case only the changed variations are updated, unless more than half
+/// of them changed. To bound the accumulation of rounding errors of the updates,
+/// the sum is recalculated from scratch after every 1000 incremental updates
+
+const double* BinnedPoissonNLL::sampleValues(Int_t s) const
+{
+  if (_morphBegin[s]==_morphEnd[s]) return &_templates[s*_nBins] ;
+
+  Int_t nSamples = _coefs.getSize() ;
+  if (_morphed.empty()) {
+    _morphed.resize(nSamples*_nBins) ;
+    _morphSum.resize(nSamples*_nBins) ;
+    _contrib.resize(_interpCode.size()*_nBins) ;
+    _morphValid.assign(nSamples,0) ;
+    _nUpdates.assign(nSamples,0) ;
+    _alphaCache.assign(_interpCode.size(),0.) ;
+  }
+
+  _changedVars.clear() ;
+  for (Int_t j=_morphBegin[s] ; j<_morphEnd[s] ; j++) {
+    double x = ((RooAbsReal&)_alphas[_alphaIndex[j]]).getVal() ;
+    if (x!=_alphaCache[j]) {
+      _alphaCache[j] = x ;
+      _changedVars.push_back(j) ;
+    }
+  }
+
+  const Int_t maxUpdates = 1000 ;
+  if (!_morphValid[s] || 2*(Int_t)_changedVars.size()>_morphEnd[s]-_morphBegin[s] || _nUpdates[s]>=maxUpdates) {
+    morphSample(s) ;
+    _morphValid[s] = 1 ;
+    _nUpdates[s] = 0 ;
+  } else if (!_changedVars.empty()) {
+    updateMorphing(s,_changedVars) ;
+    _nUpdates[s]++ ;
+  }
+  return &_morphed[s*_nBins] ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Calculate the expected event count nu_i = SUM_s c_s * T_si for all bins.
+/// This is a sequence of a*x+y operations over contiguous arrays
+
+void BinnedPoissonNLL::calculateExpected() const
+{
+  Int_t nSamples = _coefs.getSize() ;
+  _coefVals.resize(nSamples) ;
+  _nu.assign(_nBins,0.) ;
+
+  double* nu = &_nu[0] ;
+  for (Int_t s=0 ; s<nSamples ; s++) {
+    double c = _coefVals[s] = ((RooAbsReal&)_coefs[s]).getVal() ;
+    const double* t = sampleValues(s) ;
+    for (Int_t i=0 ; i<_nBins ; i++) {
+      nu[i] += c*t[i] ;
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Return -log L = SUM_i [ nu_i - n_i log(nu_i) ] - SUM log(constraints)
+
+Double_t BinnedPoissonNLL::evaluate() const
+{
+  calculateExpected() ;
+
+  const double* nu = &_nu[0] ;
+  const double* n = &_observed[0] ;
+
+  // A bin with observed events but no expected events has zero likelihood
+  Int_t nBad = 0 ;
+  for (Int_t i=0 ; i<_nBins ; i++) {
+    nBad += (nu[i]<=0 && n[i]>0) ;
+  }
+  if (nBad>0) {
+    logEvalError(Form("%d bins with observed events have a non-positive expected event count",nBad)) ;
+    return 1e30 ;
+  }
+
+  // Bins with n_i=0 contribute only nu_i, the guard on the logarithm avoids 0*log(0)
+  _terms.resize(_nBins) ;
+  double* terms = &_terms[0] ;
+  for (Int_t i=0 ; i<_nBins ; i++) {
+    terms[i] = nu[i] - n[i]*std::log(nu[i]>0 ? nu[i] : 1.) ;
+  }
+  double nll = sumArray(terms,_nBins) ;
+
+  for (Int_t j=0 ; j<_constraints.getSize() ; j++) {
+    nll -= std::log(((RooAbsPdf&)_constraints[j]).getVal(&_constrNormSet)) ;
+  }
+
+  return nll ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Calculate the gradient of -log L w.r.t the given parameters. The derivatives
+/// w.r.t. the coefficients follow analytically from a single pass over the bins
+///
+///    d(-log L)/dc_s = SUM_i T_si * (1 - n_i/nu_i)
+///
+/// and are combined with the derivatives of the coefficients w.r.t. the parameters.
+/// The latter (and the derivatives of the constraint terms) are calculated numerically,
+/// which is cheap as they do not involve any loop over the bins. For each parameter only
+/// the coefficients and constraint terms that depend on it are evaluated
+
+void BinnedPoissonNLL::gradient(const RooArgList& params, std::vector<double>& grad) const
+{
+  calculateExpected() ;
+
+  Int_t nSamples = _coefs.getSize() ;
+
+  // Weight of each bin in the derivative. The per-bin arrays are kept between calls
+  _wgt.resize(_nBins) ;
+  _prod.resize(_nBins) ;
+  double* wgt = &_wgt[0] ;
+  double* prod = &_prod[0] ;
+  const double* nu = &_nu[0] ;
+  const double* n = &_observed[0] ;
+  for (Int_t i=0 ; i<_nBins ; i++) {
+    wgt[i] = 1 - n[i]/(nu[i]>0 ? nu[i] : 1.) ;
+  }
+
+  // Derivative w.r.t each coefficient
+  std::vector<double> dcoef(nSamples) ;
+  for (Int_t s=0 ; s<nSamples ; s++) {
+    const double* t = sampleValues(s) ;
+    for (Int_t i=0 ; i<_nBins ; i++) {
+      prod[i] = t[i]*wgt[i] ;
+    }
+    dcoef[s] = sumArray(prod,_nBins) ;
+  }
+
+  // Chain rule to the parameters with central differences of the coefficients and constraints.
+  // At a boundary of the range of a parameter the difference is one-sided, since setVal()
+  // would clip a step outside the range
+  grad.assign(params.getSize(),0.) ;
+  std::vector<double> cUp(nSamples), cDown(nSamples) ;
+  const std::vector<Int_t> none ;
+  for (Int_t ip=0 ; ip<params.getSize() ; ip++) {
+    RooRealVar& par = (RooRealVar&) params[ip] ;
+    auto ic = _coefsOfParam.find(par.GetName()) ;
+    auto jc = _constrOfParam.find(par.GetName()) ;
+    const std::vector<Int_t>& coefs = (ic!=_coefsOfParam.end()) ? ic->second : none ;
+    const std::vector<Int_t>& cons = (jc!=_constrOfParam.end()) ? jc->second : none ;
+    if (coefs.empty() && cons.empty()) continue ;
+
+    double val = par.getVal() ;
+    double h = 1e-6*std::max(1.,std::fabs(val)) ;
+    double up = (par.hasMax() && val+h>par.getMax()) ? val : val+h ;
+    double down = (par.hasMin() && val-h<par.getMin()) ? val : val-h ;
+    if (up==down) continue ;
+    double consUp(0), consDown(0) ;
+
+    par.setVal(up) ;
+    for (Int_t s : coefs) cUp[s] = ((RooAbsReal&)_coefs[s]).getVal() ;
+    for (Int_t j : cons) consUp -= std::log(((RooAbsPdf&)_constraints[j]).getVal(&_constrNormSet)) ;
+
+    par.setVal(down) ;
+    for (Int_t s : coefs) cDown[s] = ((RooAbsReal&)_coefs[s]).getVal() ;
+    for (Int_t j : cons) consDown -= std::log(((RooAbsPdf&)_constraints[j]).getVal(&_constrNormSet)) ;
+
+    par.setVal(val) ;
+
+    double g = (consUp-consDown)/(up-down) ;
+    for (Int_t s : coefs) {
+      g += dcoef[s]*(cUp[s]-cDown[s])/(up-down) ;
+    }
+    grad[ip] = g ;
+  }
+
+  // Derivatives through the morphed templates, which are analytic in alpha:
+  // d(-log L)/d(alpha) = c_s * SUM_i (1 - n_i/nu_i) * (w+' eps+_i + w-' eps-_i)
+  // Bins that are truncated at zero do not depend on alpha
+  for (Int_t s=0 ; s<nSamples ; s++) {
+    const double* nom = &_templates[s*_nBins] ;
+    const double* m = sampleValues(s) ;
+    for (Int_t j=_morphBegin[s] ; j<_morphEnd[s] ; j++) {
+      Int_t ip = params.index(&_alphas[_alphaIndex[j]]) ;
+      if (ip<0) continue ;
+
+      double x = _alphaCache[j] ;
+      double wPlus, wMinus, dPlus, dMinus ;
+      morphWeights(j,x,wPlus,wMinus,dPlus,dMinus) ;
+      const double* ep = &_epsPlus[j*_nBins] ;
+      const double* em = &_epsMinus[j*_nBins] ;
+      bool clip = (_interpCode[j]==4 && x>-1 && x<1) ;
+      for (Int_t i=0 ; i<_nBins ; i++) {
+        double d = dPlus*ep[i] + dMinus*em[i] ;
+        if (clip && wPlus*ep[i] + wMinus*em[i] < -nom[i]) d = 0 ;
+        if (_posDef[s] && m[i]<=0) d = 0 ;
+        prod[i] = d*wgt[i] ;
+      }
+      grad[ip] += _coefVals[s]*sumArray(prod,_nBins) ;
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Minimize -log L with Minuit2 (Migrad followed by Hesse) using the analytic gradient
+
+Int_t BinnedPoissonNLL::minimize(Int_t printLevel)
+{
+  // Collect the floating parameters
+  RooArgSet* allParams = getParameters(RooArgSet()) ;
+  RooArgList params ;
+  TIterator* iter = allParams->createIterator() ;
+  RooAbsArg* arg ;
+  while ((arg=(RooAbsArg*)iter->Next())) {
+    RooRealVar* var = dynamic_cast<RooRealVar*>(arg) ;
+    if (var && !var->isConstant()) params.add(*var) ;
+  }
+  delete iter ;
+  delete allParams ;
+
+  GradFunction func(*this,params) ;
+
+  ROOT::Math::Minimizer* minimizer = ROOT::Math::Factory::CreateMinimizer("Minuit2","Migrad") ;
+  minimizer->SetFunction(func) ;
+  minimizer->SetErrorDef(0.5) ;
+  minimizer->SetPrintLevel(printLevel) ;
+
+  for (Int_t i=0 ; i<params.getSize() ; i++) {
+    RooRealVar& var = (RooRealVar&) params[i] ;
+    // Initial step from the error, or from the range, or for an unbounded parameter from its value
+    double step = 0.1*std::max(1.,std::fabs(var.getVal())) ;
+    if (var.getError()>0) {
+      step = var.getError() ;
+    } else if (var.hasMin() && var.hasMax()) {
+      step = 0.1*(var.getMax()-var.getMin()) ;
+    }
+    if (var.hasMin() && var.hasMax()) {
+      minimizer->SetLimitedVariable(i,var.GetName(),var.getVal(),step,var.getMin(),var.getMax()) ;
+    } else if (var.hasMin()) {
+      minimizer->SetLowerLimitedVariable(i,var.GetName(),var.getVal(),step,var.getMin()) ;
+    } else if (var.hasMax()) {
+      minimizer->SetUpperLimitedVariable(i,var.GetName(),var.getVal(),step,var.getMax()) ;
+    } else {
+      minimizer->SetVariable(i,var.GetName(),var.getVal(),step) ;
+    }
+  }
+
+  minimizer->Minimize() ;
+  minimizer->Hesse() ;
+
+  // Propagate the result to the parameters
+  for (Int_t i=0 ; i<params.getSize() ; i++) {
+    RooRealVar& var = (RooRealVar&) params[i] ;
+    var.setVal(minimizer->X()[i]) ;
+    var.setError(minimizer->Errors()[i]) ;
+  }
+
+  Int_t status = minimizer->Status() ;
+  delete minimizer ;
+  return status ;
+}
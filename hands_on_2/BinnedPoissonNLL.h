@@ -0,0 +1,143 @@
+//
+//  BinnedPoissonNLL - a fast binned Poisson likelihood for template models like that of ex12
+//
+//  The model must be a RooRealSumPdf (ASUM::model(c_1*f_1,...,c_n*f_n) in the factory language)
+//  of RooHistFunc templates or PiecewiseInterpolation morphings of RooHistFunc templates (as in ex13),
+//  optionally multiplied with constraint terms (PROD::model(model_phys,subs)). Given that the
+//  templates and the observed data do not depend on any parameter, their contents are copied
+//  once into contiguous per-sample arrays, so that the likelihood
+//
+//      -log L = SUM_i [ nu_i - n_i log(nu_i) ] - SUM_constraints log(constraint)
+//
+//         with nu_i = SUM_s c_s * T_si * binvolume_i
+//
+//  is calculated with a few tight loops over plain arrays, rather than with per-bin RooDataHist
+//  lookups and normalization integrals. The result differs from the likelihood returned by
+//  createNLL only by a constant, hence an instance can be used wherever the latter is used
+//  (RooMinimizer, createProfile, plotting etc). As for createNLL, the constraint terms are
+//  normalized over their floating parameters, and the error level is 0.5. Factors of the
+//  product other than the templates that depend on the observables are not supported.
+//
+//  For a morphed sample the differences eps+ = high-nominal and eps- = nominal-low of each
+//  variation are stored as contiguous arrays. For the piecewise linear (0) and the polynomial (4)
+//  interpolation codes the variation of each bin is then a weighted sum w+ * eps+ + w- * eps-
+//  with weights that depend only on the value of alpha, so that all bins are morphed in one
+//  pass. The contribution of each variation and the unclipped sum of the nominal template and
+//  all contributions are cached. When alpha parameters change, only the contributions of the
+//  changed variations are subtracted from the sum and added again with their new values, so that
+//  a step in a single alpha costs one pass over the bins, independent of the number of variations.
+//  The positive-definite truncation is applied to the sum when producing the morphed template.
+//  Steps in other parameters (mu, Bscale) do not touch the morphing
+//
+//  In addition the derivatives of -log L with respect to the coefficients c_s are calculated
+//  analytically in the same pass over the bins, as are those w.r.t. the alpha parameters of
+//  the morphed samples. Method minimize() passes these gradients to Minuit2 so that no numeric
+//  differentiation over the bins is needed
+//
+//  Load the compiled class in a macro with
+//
+//      R__LOAD_LIBRARY(libHistFactory)
+//      #include "BinnedPoissonNLL.cxx+"
+//
+//  or interactively with .L BinnedPoissonNLL.cxx+ (use +O to force optimization, which
+//  allows the compiler to vectorize the loops over the bins)
+//
+
+#ifndef BINNEDPOISSONNLL_H
+#define BINNEDPOISSONNLL_H
+
+#include "RooAbsReal.h"
+#include "RooAbsPdf.h"
+#include "RooDataHist.h"
+#include "RooListProxy.h"
+#include "RooArgSet.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class PiecewiseInterpolation ;
+
+class BinnedPoissonNLL : public RooAbsReal {
+public:
+  BinnedPoissonNLL() : _nBins(0), _nMorphCalc(0) {} ;
+  BinnedPoissonNLL(const char* name, const char* title, RooAbsPdf& pdf, RooDataHist& data) ;
+  BinnedPoissonNLL(const BinnedPoissonNLL& other, const char* name=0) ;
+  virtual TObject* clone(const char* newname) const { return new BinnedPoissonNLL(*this,newname) ; }
+  virtual ~BinnedPoissonNLL() {} ;
+
+  // Number of bins and number of samples (templates) of the model
+  Int_t numBins() const { return _nBins ; }
+  Int_t numSamples() const { return _coefs.getSize() ; }
+
+  // Error level of a negative log-likelihood, used by RooMinimizer and createProfile
+  virtual Double_t defaultErrorLevel() const { return 0.5 ; }
+
+  // Number of times a morphed template was recalculated (fully or incrementally)
+  Int_t numMorphRecalculations() const { return _nMorphCalc ; }
+
+  // Gradient of -log L with respect to each of the given parameters
+  void gradient(const RooArgList& params, std::vector<double>& grad) const ;
+
+  // Minimize -log L w.r.t all floating parameters with Minuit2 using analytic gradients.
+  // Fitted values and (parabolic) errors are propagated to the parameters. Returns the minimizer status
+  Int_t minimize(Int_t printLevel=-1) ;
+
+protected:
+
+  void fillTemplates(RooAbsPdf& pdf, RooDataHist& data) ;
+  void addMorphing(Int_t s, PiecewiseInterpolation& pi, RooDataHist& data) ;
+  void setupDependencies() ;
+  Double_t evaluate() const ;
+
+  // Fill _nu with the expected event count in each bin for the current coefficient values
+  void calculateExpected() const ;
+
+  // Current (morphed) template of sample s, recalculated only if one of its alphas changed
+  const double* sampleValues(Int_t s) const ;
+  void morphSample(Int_t s) const ;
+  void updateMorphing(Int_t s, const std::vector<Int_t>& changed) const ;
+  void variationContribution(Int_t s, Int_t j) const ;
+  void truncateMorphed(Int_t s) const ;
+
+  // Weights of eps+ and eps- of variation j for morphing parameter value x and their derivatives
+  void morphWeights(Int_t j, double x, double& wPlus, double& wMinus, double& dPlus, double& dMinus) const ;
+
+  RooListProxy _coefs ;        // Coefficient c_s of each sample
+  RooListProxy _constraints ;  // Constraint terms multiplying the template model
+  RooListProxy _alphas ;       // Morphing parameters
+
+  Int_t _nBins ;
+  std::vector<double> _templates ;  // Template contents times bin volume, laid out as [sample][bin]
+  std::vector<double> _observed ;   // Observed event count n_i
+
+  std::vector<Int_t> _morphBegin ;  // First variation of each sample
+  std::vector<Int_t> _morphEnd ;    // One past the last variation of each sample
+  std::vector<Int_t> _posDef ;      // Truncate morphed template of each sample at zero
+  std::vector<Int_t> _alphaIndex ;  // Index in _alphas of the parameter of each variation
+  std::vector<Int_t> _interpCode ;  // Interpolation code of each variation
+  std::vector<double> _epsPlus ;    // High minus nominal template of each variation, as [variation][bin]
+  std::vector<double> _epsMinus ;   // Nominal minus low template of each variation, as [variation][bin]
+
+  RooArgSet _constrNormSet ;                                  //! Floating parameters of the constraint terms, their normalization set
+  std::map<std::string,std::vector<Int_t> > _constrOfParam ;  //! Index of the constraint terms that depend on each parameter
+  std::map<std::string,std::vector<Int_t> > _coefsOfParam ;   //! Index of the coefficients that depend on each parameter
+
+  mutable std::vector<double> _coefVals ;   //! Current coefficient values
+  mutable std::vector<double> _nu ;         //! Current expected event counts
+  mutable std::vector<double> _morphed ;    //! Cached morphed templates as [sample][bin]
+  mutable std::vector<double> _alphaCache ; //! Alpha values of each variation used for the cached templates
+  mutable std::vector<Int_t> _morphValid ;  //! Cached morphed template of sample is valid
+  mutable std::vector<double> _morphSum ;   //! Unclipped sum of nominal and all contributions as [sample][bin]
+  mutable std::vector<double> _contrib ;    //! Cached contribution of each variation as [variation][bin]
+  mutable std::vector<Int_t> _nUpdates ;    //! Number of incremental updates of each sample since its last full calculation
+  mutable std::vector<Int_t> _changedVars ; //! Scratch list of the variations whose alpha changed
+  mutable Int_t _nMorphCalc ;               //! Number of morphed template calculations
+  mutable std::vector<double> _terms ;      //! Scratch array of the per-bin likelihood terms
+  mutable std::vector<double> _wgt ;        //! Scratch array of the per-bin derivative weights
+  mutable std::vector<double> _prod ;       //! Scratch array of the per-bin derivative terms
+
+  ClassDef(BinnedPoissonNLL,2) // Binned Poisson likelihood on flat arrays for template models
+};
+
+#endif
@@ -0,0 +1,207 @@
+//
+//  SimultaneousNLL - a per-channel and dirty-tracked likelihood for simultaneous (SIMUL)
+//                    models like the combination of ex16/ex17
+//
+//  See SimultaneousNLL.h for a description
+//
+
+#include "SimultaneousNLL.h"
+
+#include "RooSimultaneous.h"
+#include "RooAbsData.h"
+#include "RooAbsCategoryLValue.h"
+#include "RooCatType.h"
+#include "RooRealVar.h"
+#include "RooGlobalFunc.h"
+#include "TList.h"
+
+#include <cmath>
+
+ClassImp(SimultaneousNLL) ;
+
+
+namespace {
+
+  // Kahan (compensated) summation, adds y to sum while keeping track of the rounding error in c
+  inline void kahanAdd(double& sum, double& c, double y)
+  {
+    double t = sum + (y - c) ;
+    c = (t - sum) - (y - c) ;
+    sum = t ;
+  }
+
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Construct the likelihood of data for the simultaneous pdf, as the sum of the likelihoods of
+/// its channels and of the constraint terms. The global observables are the normalization set
+/// of the constraint terms
+
+SimultaneousNLL::SimultaneousNLL(const char* name, const char* title, RooSimultaneous& pdf, RooAbsData& data,
+                                 const RooArgSet& globalObs) :
+  RooAbsReal(name,title),
+  _params("params","Parameters of all channels",this),
+  _constraints("constraints","Constraint terms of all channels",this),
+  _simPdf(&pdf),
+  _data(&data),
+  _globalObs(globalObs),
+  _dataList(0),
+  _nChannelEvals(0)
+{
+  setup() ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// The channel likelihoods are not copied but constructed again for the copy
+
+SimultaneousNLL::SimultaneousNLL(const SimultaneousNLL& other, const char* name) :
+  RooAbsReal(other,name),
+  _params("params",this,other._params),
+  _constraints("constraints",this,other._constraints),
+  _simPdf(other._simPdf),
+  _data(other._data),
+  _globalObs(other._globalObs),
+  _dataList(0),
+  _nChannelEvals(0)
+{
+  setup() ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+SimultaneousNLL::~SimultaneousNLL()
+{
+  for (auto& ch : _channels) {
+    delete ch.nll ;
+    delete ch.pdf ;
+  }
+  if (_dataList) {
+    _dataList->Delete() ;
+    delete _dataList ;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Split the pdf and data in channels, collect the constraint terms of all channels,
+/// and create the likelihood of each channel without its constraint terms
+
+void SimultaneousNLL::setup()
+{
+  if (!_simPdf || !_data) return ;
+
+  const RooAbsCategoryLValue& indexCat = _simPdf->indexCat() ;
+  _dataList = _data->split(indexCat,kTRUE) ;
+  Bool_t extended = _simPdf->canBeExtended() ;
+
+  TIterator* typeIter = indexCat.typeIterator() ;
+  RooCatType* type ;
+  while ((type=(RooCatType*)typeIter->Next())) {
+    RooAbsPdf* chPdf = _simPdf->getPdf(type->GetName()) ;
+    RooAbsData* chData = (RooAbsData*) _dataList->FindObject(type->GetName()) ;
+    if (!chPdf || !chData) continue ;
+
+    Channel ch ;
+    ch.label = type->GetName() ;
+
+    // The constraint terms of the channel, found as in createNLL. Terms shared between channels
+    // are identified by name
+    RooArgSet* chParams = chPdf->getParameters(*chData) ;
+    RooArgSet* chConstraints = chPdf->getAllConstraints(*chData->get(),*chParams,kTRUE) ;
+    TIterator* citer = chConstraints->createIterator() ;
+    RooAbsArg* constr ;
+    while ((constr=(RooAbsArg*)citer->Next())) {
+      if (!_constraints.find(constr->GetName())) _constraints.add(*constr) ;
+    }
+    delete citer ;
+    delete chConstraints ;
+    delete chParams ;
+
+    // The likelihood of the channel is created on a private clone of the channel pdf, including
+    // its parameters, so that the channels share no objects. The empty Constrain() set leaves
+    // out the constraint terms, which are added once in evaluate()
+    ch.pdf = (RooAbsPdf*) chPdf->cloneTree() ;
+    ch.nll = ch.pdf->createNLL(*chData,RooFit::Extended(extended),RooFit::Constrain(RooArgSet())) ;
+
+    // Map the real-valued parameters of the original channel pdf onto those of the clone
+    RooArgSet* origParams = chPdf->getParameters(*chData) ;
+    RooArgSet* cloneParams = ch.pdf->getParameters(*chData) ;
+    TIterator* iter = origParams->createIterator() ;
+    RooAbsArg* arg ;
+    while ((arg=(RooAbsArg*)iter->Next())) {
+      RooRealVar* clonePar = dynamic_cast<RooRealVar*>(cloneParams->find(arg->GetName())) ;
+      if (!dynamic_cast<RooAbsReal*>(arg) || !clonePar) continue ;
+      if (!_params.find(arg->GetName())) _params.add(*arg) ;
+      ch.paramIndex.push_back(_params.index(_params.find(arg->GetName()))) ;
+      ch.cloneParams.push_back(clonePar) ;
+      ch.snapshot.push_back(clonePar->getVal()) ;
+    }
+    delete iter ;
+    delete cloneParams ;
+    delete origParams ;
+
+    // The first evaluation initializes the normalization integrals and caches of the channel
+    ch.value = ch.nll->getVal() ;
+    _nChannelEvals++ ;
+
+    _channels.push_back(ch) ;
+  }
+  delete typeIter ;
+
+  // Normalization set of the constraint terms: the global observables, or else the floating
+  // parameters of the constraint terms
+  _constrNormSet.removeAll() ;
+  if (_globalObs.getSize()>0) {
+    _constrNormSet.add(_globalObs) ;
+  } else {
+    for (Int_t j=0 ; j<_constraints.getSize() ; j++) {
+      RooArgSet* vars = _constraints.at(j)->getVariables() ;
+      TIterator* iter = vars->createIterator() ;
+      RooAbsArg* arg ;
+      while ((arg=(RooAbsArg*)iter->Next())) {
+        RooRealVar* var = dynamic_cast<RooRealVar*>(arg) ;
+        if (var && !var->isConstant()) _constrNormSet.add(*var,kTRUE) ;
+      }
+      delete iter ;
+      delete vars ;
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Return the sum of the channel likelihoods and of the constraint terms, recalculating
+/// only those channels for which one of the parameters changed since their last evaluation
+
+Double_t SimultaneousNLL::evaluate() const
+{
+  // Compare the parameters of each channel to its snapshot, update the private clone
+  // and recalculate the channel if one of them changed
+  for (unsigned int i=0 ; i<_channels.size() ; i++) {
+    Channel& ch = _channels[i] ;
+    bool changed = false ;
+    for (unsigned int k=0 ; k<ch.paramIndex.size() ; k++) {
+      double val = ((RooAbsReal&)_params[ch.paramIndex[k]]).getVal() ;
+      if (val!=ch.snapshot[k]) {
+        ch.snapshot[k] = val ;
+        ch.cloneParams[k]->setVal(val) ;
+        changed = true ;
+      }
+    }
+    if (changed) {
+      ch.value = ch.nll->getVal() ;
+      _nChannelEvals++ ;
+    }
+  }
+
+  // Sum the channels in a fixed order, then the constraint terms
+  double sum(0), c(0) ;
+  for (auto& ch : _channels) kahanAdd(sum,c,ch.value) ;
+  for (Int_t j=0 ; j<_constraints.getSize() ; j++) {
+    kahanAdd(sum,c,-std::log(((RooAbsPdf&)_constraints[j]).getVal(&_constrNormSet))) ;
+  }
+  return sum ;
+}
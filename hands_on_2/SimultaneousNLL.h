@@ -0,0 +1,107 @@
+//
+//  SimultaneousNLL - a per-channel and dirty-tracked likelihood for simultaneous (SIMUL)
+//                    models like the combination of ex16/ex17
+//
+//  The likelihood of SIMUL::joint_model(index,ex06=model_ex06,ex11=model_ex11) on the joint
+//  dataset is the sum of the likelihoods of the channels. The likelihood returned by createNLL
+//  evaluates all channels on every call, also when the changed parameter (e.g. alpha of ex11)
+//  only affects a single channel. Instead, this class
+//
+//   - splits the model and the data in channels, with RooSimultaneous::getPdf and
+//     RooAbsData::split on the index category, and creates a separate likelihood for each
+//     channel on a private clone of the channel pdf (so that channels share no objects)
+//   - keeps for each channel the list of parameters it depends on, and a snapshot of their
+//     values at the last evaluation of that channel. Only channels for which one of these
+//     values changed are recalculated (after copying the new values into the private clone)
+//   - sums the channel values in a fixed order with Kahan summation
+//
+//  The channels are evaluated one after the other: RooFit objects are not thread-safe (e.g.
+//  the evaluation error logging and the memory pools are shared by all objects), so channel
+//  likelihoods cannot be evaluated concurrently in threads.
+//
+//  The constraint terms (the factors of a RooProdPdf in a channel that do not depend on the
+//  observables, as found by createNLL) are collected once for the whole model, and a term that
+//  occurs in several channels (e.g. a shared luminosity constraint) is counted only once. They
+//  are left out of the channel likelihoods, and added as
+//
+//      -SUM_constraints log(constraint)
+//
+//  normalized over the global observables if these are given, or else over their floating
+//  parameters (as for the constraint terms of createNLL). The channels are extended if the
+//  RooSimultaneous can be extended, as in createNLL. Only real-valued parameters are tracked
+//
+//  Load the compiled class in a macro with
+//
+//      #include "SimultaneousNLL.cxx+"
+//
+
+#ifndef SIMULTANEOUSNLL_H
+#define SIMULTANEOUSNLL_H
+
+#include "RooAbsReal.h"
+#include "RooListProxy.h"
+#include "RooArgSet.h"
+
+#include <string>
+#include <vector>
+
+class RooSimultaneous ;
+class RooAbsData ;
+class RooRealVar ;
+class TList ;
+
+class SimultaneousNLL : public RooAbsReal {
+public:
+  SimultaneousNLL() : _simPdf(0), _data(0), _dataList(0), _nChannelEvals(0) {} ;
+  SimultaneousNLL(const char* name, const char* title, RooSimultaneous& pdf, RooAbsData& data,
+                  const RooArgSet& globalObs=RooArgSet()) ;
+  SimultaneousNLL(const SimultaneousNLL& other, const char* name=0) ;
+  virtual TObject* clone(const char* newname) const { return new SimultaneousNLL(*this,newname) ; }
+  virtual ~SimultaneousNLL() ;
+
+  // Number of channels, and name and current likelihood value of channel i
+  Int_t numChannels() const { return _channels.size() ; }
+  const char* channelName(Int_t i) const { return _channels[i].label.c_str() ; }
+  Double_t channelValue(Int_t i) const { getVal() ; return _channels[i].value ; }
+
+  // Total number of channel likelihood evaluations
+  Long64_t numChannelEvaluations() const { return _nChannelEvals ; }
+
+  // Number of (distinct) constraint terms
+  Int_t numConstraints() const { return _constraints.getSize() ; }
+
+  // Error level of a negative log-likelihood, used by RooMinimizer
+  virtual Double_t defaultErrorLevel() const { return 0.5 ; }
+
+protected:
+
+  // Likelihood of a single channel, with the parameters it depends on
+  struct Channel {
+    std::string label ;                     // State of the index category
+    RooAbsPdf* pdf ;                        // Private clone of the channel pdf
+    RooAbsReal* nll ;                       // Likelihood of the channel pdf on the channel data
+    std::vector<Int_t> paramIndex ;         // Index in _params of each parameter of the channel
+    std::vector<RooRealVar*> cloneParams ;  // Corresponding parameter of the private clone
+    std::vector<double> snapshot ;          // Parameter values at the last evaluation
+    double value ;                          // Likelihood value at the last evaluation
+  } ;
+
+  void setup() ;
+  Double_t evaluate() const ;
+
+  RooListProxy _params ;             // Parameters of all channels
+  RooListProxy _constraints ;        // Constraint terms of all channels, each counted once
+
+  RooSimultaneous* _simPdf ;         //! Simultaneous pdf
+  RooAbsData* _data ;                //! Joint data
+  RooArgSet _globalObs ;             //! Global observables
+
+  TList* _dataList ;                        //! Channel datasets, owned
+  RooArgSet _constrNormSet ;                //! Normalization set of the constraint terms
+  mutable std::vector<Channel> _channels ;  //! Channel likelihoods
+  mutable Long64_t _nChannelEvals ;         //! Number of channel likelihood evaluations
+
+  ClassDef(SimultaneousNLL,2) // Per-channel and dirty-tracked likelihood of a RooSimultaneous
+};
+
+#endif
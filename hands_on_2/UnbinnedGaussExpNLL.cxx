@@ -0,0 +1,176 @@
+//
+//  UnbinnedGaussExpNLL - a multi-threaded, columnar extended likelihood for the unbinned
+//                         Gaussian + Exponential model of ex10/ex11
+//
+//  See UnbinnedGaussExpNLL.h for a description
+//
+
+#include "UnbinnedGaussExpNLL.h"
+
+#include "RooRealVar.h"
+#include "ROOT/TThreadExecutor.hxx"
+#include "ROOT/TSeq.hxx"
+#include "TMath.h"
+#include "TString.h"
+#include "vdt/exp.h"
+#include "vdt/log.h"
+
+#include <algorithm>
+#include <cmath>
+
+ClassImp(UnbinnedGaussExpNLL) ;
+
+
+namespace {
+
+  // Kahan (compensated) summation, adds y to sum while keeping track of the rounding error in c
+  inline void kahanAdd(double& sum, double& c, double y)
+  {
+    double t = sum + (y - c) ;
+    c = (t - sum) - (y - c) ;
+    sum = t ;
+  }
+
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Construct the likelihood of data for the model SUM(nsig*Gaussian(x,mean,width),
+/// nbkg*Exponential(x,alpha)). The x column of the data is copied here
+
+UnbinnedGaussExpNLL::UnbinnedGaussExpNLL(const char* name, const char* title, RooRealVar& x, RooAbsReal& nsig, RooAbsReal& nbkg,
+                                         RooAbsReal& mean, RooAbsReal& width, RooAbsReal& alpha, RooDataSet& data, Int_t nThreads) :
+  RooAbsReal(name,title),
+  _nsig("nsig","Signal yield",this,nsig),
+  _nbkg("nbkg","Background yield",this,nbkg),
+  _mean("mean","Gaussian mean",this,mean),
+  _width("width","Gaussian width",this,width),
+  _alpha("alpha","Exponential slope",this,alpha),
+  _xlo(x.getMin()),
+  _xhi(x.getMax()),
+  _nThreads(nThreads),
+  _pool(0)
+{
+  Int_t nEvents = data.numEntries() ;
+  _x.resize(nEvents) ;
+  if (data.isWeighted()) _weights.resize(nEvents) ;
+
+  for (Int_t i=0 ; i<nEvents ; i++) {
+    const RooArgSet* row = data.get(i) ;
+    _x[i] = ((RooAbsReal*)row->find(x.GetName()))->getVal() ;
+    if (data.isWeighted()) _weights[i] = data.weight() ;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+UnbinnedGaussExpNLL::UnbinnedGaussExpNLL(const UnbinnedGaussExpNLL& other, const char* name) :
+  RooAbsReal(other,name),
+  _nsig("nsig",this,other._nsig),
+  _nbkg("nbkg",this,other._nbkg),
+  _mean("mean",this,other._mean),
+  _width("width",this,other._width),
+  _alpha("alpha",this,other._alpha),
+  _xlo(other._xlo),
+  _xhi(other._xhi),
+  _x(other._x),
+  _weights(other._weights),
+  _nThreads(other._nThreads),
+  _pool(0)
+{
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+UnbinnedGaussExpNLL::~UnbinnedGaussExpNLL()
+{
+  delete _pool ;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Return -log L = (S+B) - SUM_i w_i log( S*G(x_i) + B*E(x_i) )
+
+Double_t UnbinnedGaussExpNLL::evaluate() const
+{
+  const double S = _nsig ;
+  const double B = _nbkg ;
+  const double mean = _mean ;
+  const double width = _width ;
+  const double alpha = _alpha ;
+
+  // Analytic normalization integrals over [xlo,xhi], calculated once per parameter point
+  const double gaussInt = width*sqrt(TMath::PiOver2())*
+    (TMath::Erf((_xhi-mean)/(TMath::Sqrt2()*width)) - TMath::Erf((_xlo-mean)/(TMath::Sqrt2()*width))) ;
+  const double expoInt = (alpha==0) ? (_xhi-_xlo) : (exp(alpha*_xhi)-exp(alpha*_xlo))/alpha ;
+
+  // Fold the yields into the normalizations, so that the per-event term is
+  // log( sigCoef*exp(-0.5*u^2) + bkgCoef*exp(alpha*x) )
+  const double sigCoef = S/gaussInt ;
+  const double bkgCoef = B/expoInt ;
+  const double invWidth = 1/width ;
+
+  const Int_t nEvents = _x.size() ;
+  const Int_t nChunks = (nEvents+chunkSize-1)/chunkSize ;
+  _chunkSums.resize(nChunks) ;
+  _chunkBad.resize(nChunks) ;
+  _terms.resize(nEvents) ;
+
+  const double* xArr = _x.data() ;
+  const double* wArr = _weights.empty() ? 0 : _weights.data() ;
+
+  auto processChunk = [&](Int_t ichunk) {
+    Int_t begin = ichunk*chunkSize ;
+    Int_t end = std::min(begin+chunkSize,nEvents) ;
+
+    // Per-event terms in a branch-free loop over the column, with the inline (vectorizable)
+    // exp and log of vdt. Events with a non-positive likelihood are counted, the guard on the
+    // logarithm keeps the sum finite
+    double* terms = &_terms[begin] ;
+    const Int_t n = end-begin ;
+    const double* xs = xArr+begin ;
+    Int_t nBad = 0 ;
+#pragma omp simd reduction(+:nBad)
+    for (Int_t i=0 ; i<n ; i++) {
+      double u = (xs[i]-mean)*invWidth ;
+      double f = sigCoef*vdt::fast_exp(-0.5*u*u) + bkgCoef*vdt::fast_exp(alpha*xs[i]) ;
+      nBad += !(f>0) ;
+      terms[i] = vdt::fast_log(f>0 ? f : 1.) ;
+    }
+    _chunkBad[ichunk] = nBad ;
+    if (wArr) {
+      const double* ws = wArr+begin ;
+      for (Int_t i=0 ; i<n ; i++) terms[i] *= ws[i] ;
+    }
+
+    // Compensated sum of the terms of this chunk
+    double sum(0), c(0) ;
+    for (Int_t i=0 ; i<n ; i++) kahanAdd(sum,c,terms[i]) ;
+    _chunkSums[ichunk] = sum ;
+  } ;
+
+  if (nChunks>1) {
+    if (!_pool) _pool = new ROOT::TThreadExecutor(_nThreads) ;
+    _pool->Foreach(processChunk,ROOT::TSeqI(nChunks)) ;
+  } else if (nChunks==1) {
+    processChunk(0) ;
+  }
+
+  // Combine the chunk sums in a fixed order, so that the result does not depend on the number of threads
+  double logSum(0), c(0) ;
+  Int_t nBad = 0 ;
+  for (Int_t ichunk=0 ; ichunk<nChunks ; ichunk++) {
+    kahanAdd(logSum,c,_chunkSums[ichunk]) ;
+    nBad += _chunkBad[ichunk] ;
+  }
+
+  // An event with zero (or negative) likelihood makes the total likelihood zero
+  if (nBad>0) {
+    logEvalError(Form("%d events have a non-positive likelihood",nBad)) ;
+    return 1e30 ;
+  }
+
+  return (S+B) - logSum ;
+}